@@ -25,26 +25,48 @@ ACTION atmosstakev2::sanity()
 		int64_t total_weight = 0;
 		eosio::asset total_supply = eosio::asset(0, it->token_symbol);
 
+		auto accounts_index = accounts_table.get_index<by_public_key>();
+
 		for (auto stake = stakes_table.begin(); stake != stakes_table.end(); stake++)
 		{
+			auto account = accounts_index.find(eosio::public_key_to_fixed_bytes(stake->public_key));
+			eosio::checkf(account != accounts_index.end(), "stake %s has no account", to_string(stake->key).c_str());
+
 			total_weight += stake->weight;
-			total_supply += stake->balance;
+			total_supply += account->stake_balance(*stake);
 		}
 
+		// stakes may be short of the supply by the rounding dust held in their accounts
 		eosio::checkf(total_weight == it->total_weight, "stat->total_weight=%s, [stakes_table]->total_weight=%s", to_string(it->total_weight).c_str(), to_string(total_weight).c_str());
-		eosio::checkf(total_supply == it->total_supply, "stat->total_supply=%s, [stakes_table]->total_supply=%s", it->total_supply.to_string().c_str(), total_supply.to_string().c_str());
+		eosio::checkf(total_supply <= it->total_supply, "stat->total_supply=%s, [stakes_table]->total_supply=%s", it->total_supply.to_string().c_str(), total_supply.to_string().c_str());
 
 		total_weight = 0;
 		total_supply = eosio::asset(0, it->token_symbol);
 
+		auto stakes_index = stakes_table.get_index<by_public_key>();
+
 		for (auto acc = accounts_table.begin(); acc != accounts_table.end(); acc++)
 		{
 			total_weight += acc->total_weight;
 			total_supply += acc->total_balance;
+
+			// each account must hold exactly the weight and at least the balance of its stakes
+			int64_t acc_weight = 0;
+			eosio::asset acc_balance = eosio::asset(0, it->token_symbol);
+
+			auto pk = acc->bypk();
+			for (auto stake = stakes_index.lower_bound(pk); stake != stakes_index.end() && stake->bypk() == pk; stake++)
+			{
+				acc_weight += stake->weight;
+				acc_balance += acc->stake_balance(*stake);
+			}
+
+			eosio::checkf(acc_weight == (int64_t)acc->total_weight, "account %s total_weight=%s, [stakes_table]->total_weight=%s", to_string(acc->key).c_str(), to_string(acc->total_weight).c_str(), to_string(acc_weight).c_str());
+			eosio::checkf(acc_balance <= acc->total_balance, "account %s total_balance=%s, [stakes_table]->total_balance=%s", to_string(acc->key).c_str(), acc->total_balance.to_string().c_str(), acc_balance.to_string().c_str());
 		}
 
-		eosio::checkf(total_weight == it->total_weight, "stat->total_weight=%s, [stakes_table]->total_weight=%s", to_string(it->total_weight).c_str(), to_string(total_weight).c_str());
-		eosio::checkf(total_supply == it->total_supply, "stat->total_supply=%s, [stakes_table]->total_supply=%s", it->total_supply.to_string().c_str(), total_supply.to_string().c_str());
+		eosio::checkf(total_weight == it->total_weight, "stat->total_weight=%s, [accounts_table]->total_weight=%s", to_string(it->total_weight).c_str(), to_string(total_weight).c_str());
+		eosio::checkf(total_supply == it->total_supply, "stat->total_supply=%s, [accounts_table]->total_supply=%s", it->total_supply.to_string().c_str(), total_supply.to_string().c_str());
 	}
 
 	eosio::check(false, "Sanity is OK");
@@ -67,8 +89,22 @@ ACTION atmosstakev2::destroy()
 
 		eosio::clear_table(stakes_table);
 		eosio::clear_table(accounts_table);
+
+		this->refund_deposits(it->token_contract, it->token_symbol, "destroy");
 	}
 
+	roots roots_table(_self, _self.value);
+
+	for (auto it = roots_table.begin(); it != roots_table.end(); it++)
+	{
+		receipts receipts_table(_self, it->round);
+		eosio::clear_table(receipts_table);
+	}
+
+	usages usages_table(_self, _self.value);
+
+	eosio::clear_table(roots_table);
+	eosio::clear_table(usages_table);
 	eosio::clear_table(stats_table);
 }
 
@@ -82,7 +118,11 @@ ACTION atmosstakev2::create(
 	int64_t min_claim_secs,
 	int64_t min_stake_secs,
 	int64_t max_stake_secs,
-	eosio::asset min_stake)
+	eosio::asset min_stake,
+	uint8_t weight_curve,
+	int64_t curve_secs,
+	int64_t curve_pct,
+	eosio::asset emission_rate)
 {
 	eosio::require_auth(_self);
 
@@ -92,6 +132,12 @@ ACTION atmosstakev2::create(
 	eosio::check(min_claim_secs > 0, "min claim secs must be greater than zero");
 	eosio::check(min_stake_secs > 0, "min stake secs must be greater than zero");
 	eosio::check(max_stake_secs >= min_stake_secs, "max stake secs must be greater than or equal to min stake secs");
+	eosio::check(weight_curve <= WEIGHT_CAPPED, "unknown weight curve");
+	eosio::check(weight_curve == WEIGHT_LINEAR || curve_secs >= MINUTE_IN_SECS, "curve secs must be at least a minute");
+	eosio::check(weight_curve != WEIGHT_TIERED || (curve_pct >= 100 && curve_pct <= 1000), "curve pct must be between 100 and 1000");
+	eosio::check(emission_rate.is_valid() && emission_rate.amount >= 0 && emission_rate.symbol == token_symbol, "invalid emission rate");
+
+	auto now = eosio::current_time_point_sec();
 
 	stats stats_table(_self, _self.value);
 
@@ -108,11 +154,29 @@ ACTION atmosstakev2::create(
 			a.round_subsidy = round_subsidy;
 			a.token_contract = token_contract;
 			a.token_symbol = token_symbol;
-			a.last_claim = eosio::current_time_point_sec();
+			a.last_claim = now;
 			a.min_claim_secs = min_claim_secs;
 			a.min_stake_secs = min_stake_secs;
 			a.max_stake_secs = max_stake_secs;
 			a.min_stake = min_stake;
+			a.weight_curve.emplace(weight_curve);
+			a.curve_secs.emplace(curve_secs);
+			a.curve_pct.emplace(curve_pct);
+			a.emission_rate.emplace(emission_rate);
+			a.streamed_supply.emplace(0, token_symbol);
+			a.last_emission.emplace(now);
+			a.emission_index.emplace(0);
+		});
+
+		// a new token has no rows, so its storage report starts counted
+		usages usages_table(_self, _self.value);
+		usages_table.emplace(_self, [&](auto &a) {
+			a.token_symbol = token_symbol;
+			a.stake_rows = 0;
+			a.account_rows = 0;
+			a.stake_cursor = UINT64_MAX;
+			a.account_cursor = UINT64_MAX;
+			count_rows(a, 0, 0);
 		});
 	}
 	else
@@ -120,14 +184,22 @@ ACTION atmosstakev2::create(
 		//
 		// Updating an existing token
 		//
-		stats_table.modify(stat, _self, [&](auto &a) {
-			eosio::check(a.token_contract == token_contract, "token contract for symbol is not as expected");
-			a.round_subsidy = round_subsidy;
-			a.min_claim_secs = min_claim_secs;
-			a.min_stake_secs = min_stake_secs;
-			a.max_stake_secs = max_stake_secs;
-			a.min_stake = min_stake;
-		});
+		token_context token(_self, token_symbol);
+		this->expire_stakes(token, now);
+
+		auto &st = token.modify();
+		eosio::check(st.token_contract == token_contract, "token contract for symbol is not as expected");
+		st.emit(now); // settle the old rate first
+		st.round_subsidy = round_subsidy;
+		st.min_claim_secs = min_claim_secs;
+		st.min_stake_secs = min_stake_secs;
+		st.max_stake_secs = max_stake_secs;
+		st.min_stake = min_stake;
+		*st.weight_curve = weight_curve;
+		*st.curve_secs = curve_secs;
+		*st.curve_pct = curve_pct;
+		*st.emission_rate = emission_rate;
+		token.save();
 	}
 }
 
@@ -137,40 +209,68 @@ ACTION atmosstakev2::create(
 ACTION atmosstakev2::fexitstakes(eosio::symbol token_symbol, eosio::name stakes_to, eosio::name supply_to)
 {
 	eosio::require_auth(_self);
-	stats stats_table(_self, _self.value);
-	auto stat = stats_table.find(token_symbol.raw());
 
 	stakes stakes_table(_self, token_symbol.raw());
 	accounts accounts_table(_self, token_symbol.raw());
 
-	// eject the stakes
-	for (auto it = stakes_table.begin(); it != stakes_table.end(); it++)
+	auto now = eosio::current_time_point_sec();
+	token_context token(_self, token_symbol);
+	this->expire_stakes(token, now);
+
+	auto &st = token.modify();
+	st.emit(now);
+
+	// eject the stakes, each account holds the balances of all of its stakes
+	for (auto it = accounts_table.begin(); it != accounts_table.end(); it++)
 	{
+		auto acc = *it;
+		acc.fold_emission(st);
+
+		if (acc.total_balance.amount <= 0)
+			continue;
+
 		eosio::action(
 			permission_level{_self, name("active")},
-			stat->token_contract, name("transfer"),
-			std::make_tuple(_self, stakes_to, it->balance, eosio::public_key_to_string(it->public_key)))
+			st.token_contract, name("transfer"),
+			std::make_tuple(_self, stakes_to, acc.total_balance, eosio::public_key_to_string(acc.public_key)))
 			.send();
 	}
 
 	eosio::clear_table(stakes_table);
 	eosio::clear_table(accounts_table);
 
-	// eject the subsidy supply
-	if (supply_to != _self && stat->subsidy_supply.amount > 0)
+	this->refund_deposits(st.token_contract, token_symbol, "fexitstakes");
+
+	// both tables are empty now, so the storage report is exact
+	usages usages_table(_self, _self.value);
+	auto usage = usages_table.find(token_symbol.raw());
+	if (usage != usages_table.end())
+	{
+		usages_table.modify(usage, same_payer, [&](auto &a) {
+			a.stake_rows = 0;
+			a.account_rows = 0;
+			a.stake_cursor = UINT64_MAX;
+			a.account_cursor = UINT64_MAX;
+			count_rows(a, 0, 0);
+		});
+	}
+
+	// eject the subsidy supply, along with streaming dust which no account could claim
+	eosio::asset supply = st.subsidy_supply + *st.streamed_supply;
+	if (supply_to != _self && supply.amount > 0)
 	{
 		eosio::action(
 			permission_level{_self, name("active")},
-			stat->token_contract, name("transfer"),
-			std::make_tuple(_self, supply_to, stat->subsidy_supply, "fexitstakes"s))
+			st.token_contract, name("transfer"),
+			std::make_tuple(_self, supply_to, supply, "fexitstakes"s))
 			.send();
 	}
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.total_supply = eosio::asset(0, token_symbol);
-		a.subsidy_supply = eosio::asset(0, token_symbol);
-		a.total_weight = 0;
-	});
+	st.total_supply = eosio::asset(0, token_symbol);
+	st.subsidy_supply = eosio::asset(0, token_symbol);
+	*st.streamed_supply = eosio::asset(0, token_symbol);
+	st.total_weight = 0;
+	token.save();
 }
 
 //
@@ -184,50 +284,76 @@ ACTION atmosstakev2::exitstake(uint64_t key, eosio::symbol token_symbol, eosio::
 	eosio::check(token_symbol.is_valid(), "invalid token symbol");
 
 	stakes stakes_table(_self, token_symbol.raw());
-	stats stats_table(_self, _self.value);
 	accounts accounts_table(_self, token_symbol.raw());
 	auto accounts_index = accounts_table.get_index<by_public_key>();
 
 	auto now = eosio::current_time_point_sec();
 
+	// drain expiries first, so the rows loaded below include their changes
+	token_context token(_self, token_symbol, "stat not found");
+	this->expire_stakes(token, now);
+
 	auto stake = stakes_table.find(key);
 	eosio::check(stake != stakes_table.end(), "stake not found");
 	eosio::check(now >= stake->expires, "stake is not yet expired");
 
-	string msg = eosio::format_string("atmosstakev2 unstake:%s %s %s", to_string(key).c_str(), to.to_string().c_str(), memo.c_str());
-	eosio::checksum256 digest = eosio::sha256(msg.c_str(), msg.length());
-	eosio::assert_recover_key(digest, sig, stake->public_key);
+	eosio::check(memo.size() <= 256, "memo has more than 256 bytes");
 
-	auto stat = stats_table.find(stake->balance.symbol.raw());
-	eosio::check(stat != stats_table.end(), "stat not found");
-	eosio::check(stat->total_supply >= stake->balance, "insufficient supply");
+	eosio::fixed_string<320> msg;
+	msg.append("atmosstakev2 unstake:").append(key).append(" ").append(to).append(" ").append(memo);
+	eosio::checksum256 digest = eosio::sha256(msg.data, msg.size);
+	eosio::assert_recover_key(digest, sig, stake->public_key);
 
 	auto account = accounts_index.find(eosio::public_key_to_fixed_bytes(stake->public_key));
 	eosio::check(account != accounts_index.end(), "account not found");
 
-	stakes_table.erase(stake);
+	// fold streamed rewards into the account before its weight changes
+	auto &st = token.modify();
+	st.emit(now);
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.total_supply -= stake->balance;
-		a.total_weight -= stake->weight;
-	});
+	auto acc = *account;
+	acc.fold_emission(st);
+
+	eosio::asset balance = acc.stake_balance(*stake);
+	int64_t weight = stake->weight;
+
+	stakes_table.erase(stake);
 
-	if (stake->balance.amount == account->total_balance.amount)
+	// the last stake of an account also takes the rounding dust left in it
+	auto stakes_index = stakes_table.get_index<by_public_key>();
+	bool last = (stakes_index.find(acc.bypk()) == stakes_index.end());
+	if (last)
 	{
+		balance = acc.total_balance;
 		accounts_index.erase(account);
 	}
 	else
 	{
 		accounts_index.modify(account, same_payer, [&](auto &a) {
-			a.total_balance -= stake->balance;
-			a.total_weight -= stake->weight;
+			a = acc;
+			a.total_balance -= balance;
+			a.total_weight -= weight;
 		});
 	}
 
+	this->track_usage(token_symbol, key, -1, acc.key, last ? -1 : 0);
+
+	eosio::check(st.total_supply >= balance, "insufficient supply");
+
+	st.total_supply -= balance;
+	st.total_weight -= weight;
+	token.save();
+
+	eosio::action(
+		permission_level{_self, "active"_n},
+		_self, "logexit"_n,
+		std::make_tuple(token_symbol, key, balance))
+		.send();
+
 	eosio::action(
 		permission_level{_self, name("active")},
-		stat->token_contract, name("transfer"),
-		std::make_tuple(_self, to, stake->balance, memo))
+		token->token_contract, name("transfer"),
+		std::make_tuple(_self, to, balance, memo))
 		.send();
 }
 
@@ -238,12 +364,14 @@ ACTION atmosstakev2::resetclaim(eosio::symbol token_symbol)
 {	
 	eosio::require_auth(_self);	
 	
-	stats stats_table(_self, _self.value);
-	auto stat = stats_table.find(token_symbol.raw());
+	auto now = eosio::current_time_point_sec();
+	token_context token(_self, token_symbol);
+	this->expire_stakes(token, now);
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.last_claim -= stat->min_claim_secs;
-	});
+	auto &st = token.modify();
+	st.emit(now);
+	st.last_claim -= st.min_claim_secs;
+	token.save();
 }
 
 //
@@ -256,128 +384,796 @@ ACTION atmosstakev2::claim(eosio::symbol token_symbol, eosio::name relay, string
 	eosio::check(relay != _self, "self cannot relay");
 	eosio::check(token_symbol.is_valid(), "invalid token symbol");
 
-	stakes stakes_table(_self, token_symbol.raw());
-	stats stats_table(_self, _self.value);
 	accounts accounts_table(_self, token_symbol.raw());
-	auto accounts_index = accounts_table.get_index<by_public_key>();
 
 	auto now = eosio::current_time_point_sec();
-	auto stat = stats_table.find(token_symbol.raw());
-	eosio::check(stat != stats_table.end(), "token not found");
+	token_context token(_self, token_symbol);
+	this->expire_stakes(token, now);
+	token.modify().emit(now); // stream up to now before the subsidy supply changes
+	const auto &stat = *token;
 
-	auto time_delta = eosio::time_diff_secs(now, stat->last_claim);
-	eosio::checkf(time_delta >= stat->min_claim_secs, "it has not been a sufficient amount of time since the last claim() call, remaining secs: %d", (stat->min_claim_secs - time_delta));
+	auto time_delta = eosio::time_diff_secs(now, stat.last_claim);
+	eosio::checkf(time_delta >= stat.min_claim_secs, "it has not been a sufficient amount of time since the last claim() call, remaining secs: %lld", (long long)(stat.min_claim_secs - time_delta));
 
-	eosio::check(stat->subsidy_supply >= stat->round_subsidy, "insufficient subsidy");
+	eosio::check(stat.subsidy_supply >= stat.round_subsidy, "insufficient subsidy");
 
-	eosio::asset subsidy(stat->round_subsidy.amount * 99 / 100, token_symbol);
-	eosio::check(subsidy.is_valid() && stat->round_subsidy > subsidy, "invalid subsidy");
+	eosio::asset subsidy(stat.round_subsidy.amount * 99 / 100, token_symbol);
+	eosio::check(subsidy.is_valid() && stat.round_subsidy > subsidy, "invalid subsidy");
 
-	eosio::asset relay_subsidy(stat->round_subsidy.amount * 1 / 100, token_symbol);
+	eosio::asset relay_subsidy(stat.round_subsidy.amount * 1 / 100, token_symbol);
 	eosio::check(relay_subsidy.is_valid(), "invalid relay subsidy");
 	eosio::check(relay_subsidy.amount > 0, "relay subsidy must be greater than zero, increase relay subsidy by recalling create");
 
-	for (auto stake = stakes_table.begin(); stake != stakes_table.end(); stake++)
+	//
+	// Rewards are paid per account, each stake takes its share from the account reward index when it exits
+	//
+	eosio::asset distributed(0, token_symbol);
+
+	for (auto account = accounts_table.begin(); account != accounts_table.end(); account++)
 	{
-		eosio::asset reward(subsidy.amount * (stake->weight) / (stat->total_weight), token_symbol);
+		if (account->total_weight == 0)
+			continue;
+
+		// 128-bit product, a heavy account's weight times the subsidy exceeds 64 bits
+		eosio::asset reward((int64_t)((__int128)subsidy.amount * account->total_weight / stat.total_weight), token_symbol);
 
 		if (reward.amount <= 0 || !reward.is_valid())
 			continue; // ignore, insufficient amount
 
-		auto account = accounts_index.find(eosio::public_key_to_fixed_bytes(stake->public_key));
-		eosio::check(account != accounts_index.end(), "account not found");
+		accounts_table.modify(account, same_payer, [&](auto &a) {
+			a.add_reward(reward);
+		});
+
+		distributed += reward;
+	}
+
+	// rounding dust which was not distributed remains in the subsidy supply
+	auto &st = token.modify();
+	st.subsidy_supply -= distributed + relay_subsidy;
+	st.total_supply += distributed;
+	st.last_claim = now;
+	token.save();
+
+	// every account with a positive reward received subsidy * total_weight / stat total_weight
+	eosio::action(
+		permission_level{_self, "active"_n},
+		_self, "logclaim"_n,
+		std::make_tuple(token_symbol, now, subsidy, stat.total_weight))
+		.send();
 
-		stakes_table.modify(stake, same_payer, [&](auto &a) {
-			a.balance += reward;
+	eosio::action(
+		permission_level{_self, "active"_n},
+		stat.token_contract, "transfer"_n,
+		std::make_tuple(_self, relay, relay_subsidy, memo))
+		.send();
+}
+
+//
+// Change log actions, these do nothing other than appear in the action traces
+//
+ACTION atmosstakev2::logstake(eosio::symbol token_symbol, uint64_t key, eosio::public_key public_key, eosio::asset balance, int64_t weight, eosio::time_point_sec expires)
+{
+	eosio::require_auth(_self);
+}
+
+ACTION atmosstakev2::logexit(eosio::symbol token_symbol, uint64_t key, eosio::asset balance)
+{
+	eosio::require_auth(_self);
+}
+
+ACTION atmosstakev2::logclaim(eosio::symbol token_symbol, eosio::time_point_sec round, eosio::asset subsidy, int64_t total_weight)
+{
+	eosio::require_auth(_self);
+}
+
+ACTION atmosstakev2::logexpire(eosio::symbol token_symbol, uint64_t key, eosio::asset balance, int64_t weight)
+{
+	eosio::require_auth(_self);
+}
+
+// reply of exportstakes(), read from its action trace
+ACTION atmosstakev2::exportbatch(eosio::symbol token_symbol, export_batch batch)
+{
+	eosio::require_auth(_self);
+}
+
+//
+// Alternative to claim() for large scopes, rewards for the round are computed off-chain
+// The whole [round_subsidy] is reserved and each account settles its own leaf with settle()
+// Leaves are sha256(pack(round, public_key, reward)) where reward = round_subsidy * account weight / total_weight
+//
+ACTION atmosstakev2::setroot(eosio::symbol token_symbol, eosio::checksum256 merkle_root)
+{
+	eosio::require_auth(_self);
+	eosio::check(token_symbol.is_valid(), "invalid token symbol");
+
+	roots roots_table(_self, _self.value);
+
+	auto now = eosio::current_time_point_sec();
+	token_context token(_self, token_symbol);
+	this->expire_stakes(token, now);
+
+	auto &st = token.modify();
+	st.emit(now);
+
+	auto time_delta = eosio::time_diff_secs(now, st.last_claim);
+	eosio::checkf(time_delta >= st.min_claim_secs, "it has not been a sufficient amount of time since the last claim() call, remaining secs: %lld", (long long)(st.min_claim_secs - time_delta));
+
+	eosio::check(st.subsidy_supply >= st.round_subsidy, "insufficient subsidy");
+
+	roots_table.emplace(_self, [&](auto &a) {
+		a.round = roots_table.available_primary_key();
+		a.token_symbol = token_symbol;
+		a.merkle_root = merkle_root;
+		a.remaining = st.round_subsidy;
+		a.created = now;
+	});
+
+	st.subsidy_supply -= st.round_subsidy;
+	st.last_claim = now;
+	token.save();
+}
+
+//
+// Can be called by anyone
+// Credits the reward of [public_key] for [round] after verifying its Merkle [proof]
+// The reward is spread over the stakes the account holds now, not those it held at setroot(),
+// so stakes added since share it. An account left without weight keeps the reward in its
+// total_balance, which is paid to its last stake to exit
+//
+ACTION atmosstakev2::settle(uint64_t round, eosio::public_key public_key, eosio::asset reward, std::vector<eosio::checksum256> proof)
+{
+	eosio::check(proof.size() <= 64, "proof is too long");
+
+	roots roots_table(_self, _self.value);
+	auto root = roots_table.find(round);
+	eosio::check(root != roots_table.end(), "round not found");
+	eosio::check(reward.symbol == root->token_symbol && reward.amount > 0, "invalid reward");
+	eosio::check(root->remaining >= reward, "insufficient round subsidy");
+
+	auto packed = eosio::pack(std::make_tuple(round, public_key, reward));
+	eosio::checksum256 leaf = eosio::sha256(packed.data(), packed.size());
+	eosio::check(eosio::merkle_root_from_proof(leaf, proof) == root->merkle_root, "invalid proof");
+
+	auto pk = eosio::public_key_to_fixed_bytes(public_key);
+
+	receipts receipts_table(_self, round);
+	auto receipts_index = receipts_table.get_index<by_public_key>();
+	eosio::check(receipts_index.find(pk) == receipts_index.end(), "already settled");
+
+	accounts accounts_table(_self, reward.symbol.raw());
+	auto accounts_index = accounts_table.get_index<by_public_key>();
+
+	auto now = eosio::current_time_point_sec();
+	token_context token(_self, reward.symbol);
+	this->expire_stakes(token, now);
+
+	auto &st = token.modify();
+	st.emit(now);
+
+	auto account = accounts_index.find(pk);
+	eosio::check(account != accounts_index.end(), "account not found");
+
+	receipts_table.emplace(_self, [&](auto &a) {
+		a.key = receipts_table.available_primary_key();
+		a.public_key = public_key;
+	});
+
+	accounts_index.modify(account, same_payer, [&](auto &a) {
+		a.add_reward(reward);
+	});
+
+	roots_table.modify(root, same_payer, [&](auto &a) {
+		a.remaining -= reward;
+	});
+
+	st.total_supply += reward;
+	token.save();
+}
+
+//
+// Admin function for retiring a settlement round, unsettled rewards return to the subsidy supply
+// The first call returns them, which stops further settle() calls for the round
+// Each call erases up to [max_rows] receipts, the round is erased by the call that erases the last
+//
+ACTION atmosstakev2::closeround(uint64_t round, uint32_t max_rows)
+{
+	eosio::require_auth(_self);
+	eosio::check(max_rows > 0, "max rows must be greater than zero");
+
+	roots roots_table(_self, _self.value);
+	auto root = roots_table.find(round);
+	eosio::check(root != roots_table.end(), "round not found");
+
+	if (root->remaining.amount > 0)
+	{
+		// stream up to now first, so the returned subsidy is not streamed for time before it was returned
+		auto now = eosio::current_time_point_sec();
+		token_context token(_self, root->token_symbol);
+		this->expire_stakes(token, now);
+
+		auto &st = token.modify();
+		st.emit(now);
+		st.subsidy_supply += root->remaining;
+		token.save();
+
+		roots_table.modify(root, same_payer, [&](auto &a) {
+			a.remaining.amount = 0;
 		});
+	}
 
-		accounts_index.modify(account, same_payer, [&](auto &a) {
-			a.total_balance += reward;
+	receipts receipts_table(_self, round);
+
+	auto receipt = receipts_table.begin();
+	for (uint32_t i = 0; i < max_rows && receipt != receipts_table.end(); i++)
+		receipt = receipts_table.erase(receipt);
+
+	if (receipt == receipts_table.end())
+		roots_table.erase(root);
+}
+
+//
+// Admin function for counting the rows of [token_symbol] into its storage report
+// Needed once for tokens created before the report existed, whose rows were never counted
+// The first call starts a scan, each call counts up to [max_rows] rows until both tables are counted
+//
+ACTION atmosstakev2::recount(eosio::symbol token_symbol, uint32_t max_rows)
+{
+	eosio::require_auth(_self);
+	eosio::check(token_symbol.is_valid(), "invalid token symbol");
+	eosio::check(max_rows > 0, "max rows must be greater than zero");
+
+	stats stats_table(_self, _self.value);
+	eosio::check(stats_table.find(token_symbol.raw()) != stats_table.end(), "token not found");
+
+	usages usages_table(_self, _self.value);
+	auto usage = usages_table.find(token_symbol.raw());
+
+	struct usage u{};
+	u.token_symbol = token_symbol;
+
+	// continue a running scan, otherwise start over from zero
+	if (usage != usages_table.end() && (usage->stake_cursor != UINT64_MAX || usage->account_cursor != UINT64_MAX))
+		u = *usage;
+
+	int64_t stake_rows = 0;
+	int64_t account_rows = 0;
+
+	if (u.stake_cursor != UINT64_MAX)
+	{
+		stakes stakes_table(_self, token_symbol.raw());
+
+		auto stake = stakes_table.lower_bound(u.stake_cursor);
+		for (; stake != stakes_table.end() && stake_rows < max_rows; stake++)
+			stake_rows++;
+
+		u.stake_cursor = (stake == stakes_table.end()) ? UINT64_MAX : stake->key;
+	}
+
+	if (u.stake_cursor == UINT64_MAX && u.account_cursor != UINT64_MAX)
+	{
+		accounts accounts_table(_self, token_symbol.raw());
+
+		auto account = accounts_table.lower_bound(u.account_cursor);
+		for (; account != accounts_table.end() && stake_rows + account_rows < max_rows; account++)
+			account_rows++;
+
+		u.account_cursor = (account == accounts_table.end()) ? UINT64_MAX : account->key;
+	}
+
+	count_rows(u, stake_rows, account_rows);
+
+	if (usage == usages_table.end())
+	{
+		usages_table.emplace(_self, [&](auto &a) {
+			a = u;
+		});
+	}
+	else
+	{
+		usages_table.modify(usage, same_payer, [&](auto &a) {
+			a = u;
 		});
 	}
+}
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.subsidy_supply -= stat->round_subsidy;
-		a.total_supply += subsidy;
-		a.last_claim = now;
-	});
+//
+// Admin function for rebuilding the index entries of stakes written before the expiry index existed
+// Rewrites up to [max_rows] stakes from primary key [lower_bound], call again past the last key rewritten
+// Stakes without an expiry entry are never drained and cannot be modified, so run this once over every scope
+//
+ACTION atmosstakev2::reindex(eosio::symbol token_symbol, uint64_t lower_bound, uint32_t max_rows)
+{
+	eosio::require_auth(_self);
+	eosio::check(token_symbol.is_valid(), "invalid token symbol");
+	eosio::check(max_rows > 0, "max rows must be greater than zero");
+
+	stakes stakes_table(_self, token_symbol.raw());
+
+	auto stake = stakes_table.lower_bound(lower_bound);
+	for (uint32_t i = 0; i < max_rows && stake != stakes_table.end(); i++)
+	{
+		// erase() skips missing index entries, emplace() writes all of them
+		auto row = *stake;
+		if (!row.reward_index.has_value())
+			row.reward_index.emplace(0);
+
+		stake = stakes_table.erase(stake);
+
+		stakes_table.emplace(_self, [&](auto &a) {
+			a = row;
+		});
+	}
+}
+
+//
+// Called by [owner] to stake many keys at once from funds sent with a `deposit` transfer memo
+// Entries are applied in key hash order, so each distinct key costs a single account lookup
+// Any part of the deposit not staked remains for later calls
+//
+ACTION atmosstakev2::bulkstake(eosio::name owner, eosio::symbol token_symbol, std::vector<bulk_entry> entries)
+{
+	eosio::require_auth(owner);
+	eosio::check(token_symbol.is_valid(), "invalid token symbol");
+	eosio::check(entries.size() > 0, "expected at least one entry");
+
+	deposits deposits_table(_self, token_symbol.raw());
+	stakes stakes_table(_self, token_symbol.raw());
+	accounts accounts_table(_self, token_symbol.raw());
+
+	token_context token(_self, token_symbol);
+
+	auto deposit = deposits_table.find(owner.value);
+	eosio::check(deposit != deposits_table.end(), "deposit not found");
+
+	auto now = eosio::current_time_point_sec();
+	this->expire_stakes(token, now);
+
+	auto &st = token.modify();
+	st.emit(now);
+
+	std::vector<int64_t> weights(entries.size());
+	std::vector<std::pair<eosio::checksum256, uint32_t>> order;
+	order.reserve(entries.size());
+
+	eosio::asset total_balance(0, token_symbol);
+	int64_t total_weight = 0;
+
+	for (uint32_t i = 0; i < entries.size(); i++)
+	{
+		weights[i] = st.stake_weight(entries[i].balance, entries[i].expires, now);
+		total_balance += entries[i].balance;
+		eosio::check(weights[i] <= INT64_MAX - total_weight, "total weight is too large");
+		total_weight += weights[i];
+		order.emplace_back(eosio::public_key_to_fixed_bytes(entries[i].public_key), i);
+	}
+
+	eosio::check(total_balance <= deposit->balance, "entries exceed the deposit");
+
+	std::sort(order.begin(), order.end());
+
+	const uint64_t first_key = stakes_table.available_primary_key();
+	const uint64_t first_account_key = accounts_table.available_primary_key();
+
+	uint64_t key = first_key;
+	int64_t new_accounts = 0;
+
+	for (size_t i = 0; i < order.size();)
+	{
+		const auto &pk = order[i].first;
+		const auto &public_key = entries[order[i].second].public_key;
+
+		// totals for this key
+		size_t end = i;
+		eosio::asset balance(0, token_symbol);
+		int64_t weight = 0;
+		for (; end < order.size() && order[end].first == pk; end++)
+		{
+			balance += entries[order[end].second].balance;
+			weight += weights[order[end].second];
+		}
+
+		bool created;
+		account acc = this->upsert_account(st, accounts_table, public_key, pk, balance, weight, created);
+		new_accounts += created ? 1 : 0;
+
+		for (; i < end; i++)
+		{
+			const auto &entry = entries[order[i].second];
+			int64_t stake_weight = weights[order[i].second];
+
+			stakes_table.emplace(_self, [&](auto &a) {
+				a.key = key;
+				a.weight = stake_weight;
+				a.public_key = entry.public_key;
+				a.initial_balance = entry.balance;
+				a.balance = entry.balance;
+				a.expires = entry.expires;
+				a.reward_index.emplace(*acc.reward_index);
+			});
+
+			eosio::action(
+				permission_level{_self, "active"_n},
+				_self, "logstake"_n,
+				std::make_tuple(token_symbol, key, entry.public_key, entry.balance, stake_weight, entry.expires))
+				.send();
+
+			key++;
+		}
+	}
+
+	st.total_supply += total_balance;
+	st.add_weight(total_weight);
+	token.save();
+
+	if (total_balance == deposit->balance)
+	{
+		deposits_table.erase(deposit);
+	}
+	else
+	{
+		deposits_table.modify(deposit, same_payer, [&](auto &a) {
+			a.balance -= total_balance;
+		});
+	}
+
+	this->track_usage(token_symbol, first_key, entries.size(), first_account_key, new_accounts);
+}
+
+//
+// Called by [owner] to take back [quantity] of a deposit which was not staked
+//
+ACTION atmosstakev2::withdraw(eosio::name owner, eosio::asset quantity)
+{
+	eosio::require_auth(owner);
+	eosio::check(quantity.is_valid() && quantity.amount > 0, "invalid quantity");
+
+	stats stats_table(_self, _self.value);
+	auto stat = stats_table.find(quantity.symbol.raw());
+	eosio::check(stat != stats_table.end(), "token not found");
+
+	deposits deposits_table(_self, quantity.symbol.raw());
+	auto deposit = deposits_table.find(owner.value);
+	eosio::check(deposit != deposits_table.end(), "deposit not found");
+	eosio::check(quantity <= deposit->balance, "quantity exceeds the deposit");
+
+	if (quantity == deposit->balance)
+	{
+		deposits_table.erase(deposit);
+	}
+	else
+	{
+		deposits_table.modify(deposit, same_payer, [&](auto &a) {
+			a.balance -= quantity;
+		});
+	}
 
 	eosio::action(
 		permission_level{_self, "active"_n},
 		stat->token_contract, "transfer"_n,
-		std::make_tuple(_self, relay, relay_subsidy, memo))
+		std::make_tuple(_self, owner, quantity, "withdraw"s))
 		.send();
 }
 
 //
-// Inline called when receiving a transfer to purpose it to be staked
+// Can be called by anyone, changes no state
+// Replies with the stakes for [token_symbol] starting at primary key [lower_bound] through an inline exportbatch()
+// Rows are added until the packed batch reaches [max_bytes], at most MAX_EXPORT_BYTES so the reply fits an inline action
 //
-void atmosstakev2::stake(eosio::public_key public_key, eosio::asset balance, eosio::time_point_sec expires)
+ACTION atmosstakev2::exportstakes(eosio::symbol token_symbol, uint64_t lower_bound, uint32_t max_bytes)
 {
-	accounts accounts_table(_self, balance.symbol.raw());
-	stakes stakes_table(_self, balance.symbol.raw());
+	eosio::check(token_symbol.is_valid(), "invalid token symbol");
+
 	stats stats_table(_self, _self.value);
+	stakes stakes_table(_self, token_symbol.raw());
+	accounts accounts_table(_self, token_symbol.raw());
+	auto accounts_index = accounts_table.get_index<by_public_key>();
 
-	auto stat = stats_table.find(balance.symbol.raw());
+	auto stat = stats_table.find(token_symbol.raw());
 	eosio::check(stat != stats_table.end(), "token not found");
-	eosio::check(balance >= stat->min_stake, "amount does not meet the minimum stake requirement");
+
+	// balances include rewards streamed up to now, as if each account was folded
+	auto st = *stat;
+	st.emit(eosio::current_time_point_sec());
+
+	const size_t row_size = eosio::pack_size(export_row{});
+	const size_t header_size = eosio::pack_size(export_batch{});
+	eosio::check(max_bytes >= header_size + 4 + row_size, "max bytes is too small for a single row");
+	eosio::check(max_bytes <= MAX_EXPORT_BYTES, "max bytes is too large for an inline action");
+
+	export_batch batch;
+	batch.rows.reserve((max_bytes - header_size) / row_size);
+	batch.more = false;
+
+	auto stake = stakes_table.lower_bound(lower_bound);
+	account acc{};
+	auto account = accounts_index.end();
+	size_t size = header_size + 4; // room for the varuint32 length prefix of [rows] to grow
+
+	for (; stake != stakes_table.end(); stake++)
+	{
+		if (size + row_size > max_bytes)
+		{
+			batch.more = true;
+			break;
+		}
+
+		// stakes of the same key are often adjacent, avoid re-hashing the key
+		if (account == accounts_index.end() || account->public_key != stake->public_key)
+		{
+			account = accounts_index.find(eosio::public_key_to_fixed_bytes(stake->public_key));
+			eosio::check(account != accounts_index.end(), "account not found");
+
+			acc = *account;
+			acc.fold_emission(st);
+		}
+
+		batch.rows.push_back(export_row{stake->key, stake->weight, acc.stake_balance(*stake), stake->expires, acc.key});
+		size += row_size;
+	}
+
+	batch.next_key = batch.more ? stake->key : 0;
+
+	eosio::action(
+		permission_level{_self, "active"_n},
+		_self, "exportbatch"_n,
+		std::make_tuple(token_symbol, batch))
+		.send();
+}
+
+//
+// Inline called when receiving a transfer to purpose it to be staked
+//
+void atmosstakev2::stake(token_context &token, eosio::public_key public_key, eosio::asset balance, eosio::time_point_sec expires)
+{
+	accounts accounts_table(_self, balance.symbol.raw());
+	stakes stakes_table(_self, balance.symbol.raw());
 
 	auto now = eosio::current_time_point_sec();
-	eosio::check(expires >= (now + stat->min_stake_secs), "the staking period is too short");
-	eosio::check(expires <= (now + stat->max_stake_secs), "the staking period is too long");
+	int64_t weight = token->stake_weight(balance, expires, now);
 
-	int64_t weight = (balance.amount / 10000) * (eosio::time_diff_secs(expires, now) / 60);
-	eosio::check(weight > 0, "weight must be greater than zero");
+	auto &st = token.modify();
+	st.emit(now);
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.total_supply += balance;
-		a.total_weight += weight;
-	});
+	bool new_account;
+	account acc = this->upsert_account(st, accounts_table, public_key, eosio::public_key_to_fixed_bytes(public_key), balance, weight, new_account);
+
+	st.total_supply += balance;
+	st.add_weight(weight);
+
+	uint64_t key = stakes_table.available_primary_key();
 
 	stakes_table.emplace(_self, [&](auto &a) {
-		a.key = stakes_table.available_primary_key();
+		a.key = key;
 		a.weight = weight;
 		a.public_key = public_key;
 		a.initial_balance = balance;
 		a.balance = balance;
 		a.expires = expires;
+		a.reward_index.emplace(*acc.reward_index);
 	});
 
+	this->track_usage(balance.symbol, key, 1, acc.key, new_account ? 1 : 0);
+
+	eosio::action(
+		permission_level{_self, "active"_n},
+		_self, "logstake"_n,
+		std::make_tuple(balance.symbol, key, public_key, balance, weight, expires))
+		.send();
+}
+
+//
+// Adds new stakes of [balance] and [weight] to the account of [public_key], creating it if needed
+// Streamed rewards are folded into an existing account before its weight changes
+// Returns the account as written, new stakes are settled at its reward index
+//
+atmosstakev2::account atmosstakev2::upsert_account(stat &st, accounts &accounts_table, const eosio::public_key &public_key, const eosio::checksum256 &pk, eosio::asset balance, int64_t weight, bool &created)
+{
 	auto accounts_index = accounts_table.get_index<by_public_key>();
-	auto account = accounts_index.find(eosio::public_key_to_fixed_bytes(public_key));
-	if (account == accounts_index.end())
+	auto it = accounts_index.find(pk);
+
+	account acc{};
+
+	created = (it == accounts_index.end());
+	if (created)
 	{
+		acc.key = accounts_table.available_primary_key();
+		acc.public_key = public_key;
+		acc.total_balance = balance;
+		acc.total_weight = weight;
+		acc.reward_index.emplace(0);
+		acc.emission_index.emplace(*st.emission_index);
+
 		accounts_table.emplace(_self, [&](auto &a) {
-			a.key = accounts_table.available_primary_key();
-			a.public_key = public_key;
-			a.total_balance = balance;
-			a.total_weight = weight;
+			a = acc;
 		});
 	}
 	else
 	{
-		accounts_index.modify(account, same_payer, [&](auto &a) {
-			a.total_balance += balance;
-			a.total_weight += weight;
+		acc = *it;
+		acc.fold_emission(st);
+		acc.total_balance += balance;
+		acc.total_weight += weight;
+
+		accounts_index.modify(it, same_payer, [&](auto &a) {
+			a = acc;
 		});
 	}
+
+	return acc;
 }
 
 //
-// Inline called when receiving a transfer which is a subsidy
+// Tracks [stake_rows] and [account_rows] added (positive) or removed (negative) for the storage report
+// [stake_key] and [account_key] are the lowest keys changed, rows past the cursors of a running recount()
+// are left for it to count. Added rows always take keys past every existing row, so they are all on one side
 //
-void atmosstakev2::addsubsidy(eosio::asset balance)
+void atmosstakev2::track_usage(eosio::symbol token_symbol, uint64_t stake_key, int64_t stake_rows, uint64_t account_key, int64_t account_rows)
 {
-	stats stats_table(_self, _self.value);
+	usages usages_table(_self, _self.value);
+	auto usage = usages_table.find(token_symbol.raw());
 
-	auto stat = stats_table.find(balance.symbol.raw());
-	eosio::check(stat != stats_table.end(), "token not found");
+	// not counted until recount() seeds the report
+	if (usage == usages_table.end())
+		return;
+
+	if (stake_key >= usage->stake_cursor)
+		stake_rows = 0;
+	if (account_key >= usage->account_cursor)
+		account_rows = 0;
 
-	stats_table.modify(stat, same_payer, [&](auto &a) {
-		a.subsidy_supply += balance;
+	if (stake_rows == 0 && account_rows == 0)
+		return;
+
+	usages_table.modify(usage, same_payer, [&](auto &a) {
+		count_rows(a, stake_rows, account_rows);
 	});
 }
 
+//
+// Adds [stake_rows] and [account_rows] to the counts of [u] and recomputes its byte estimates
+// Counts stop at zero rather than wrapping around
+//
+void atmosstakev2::count_rows(usage &u, int64_t stake_rows, int64_t account_rows)
+{
+	struct stake full_stake{}; // [stake] alone names the member function
+	full_stake.reward_index.emplace(0);
+
+	account full_account{};
+	full_account.upgrade();
+
+	const uint64_t stake_bytes = eosio::pack_size(full_stake);
+	const uint64_t account_bytes = eosio::pack_size(full_account);
+
+	u.stake_rows = (stake_rows < 0 && (uint64_t)-stake_rows > u.stake_rows) ? 0 : u.stake_rows + stake_rows;
+	u.account_rows = (account_rows < 0 && (uint64_t)-account_rows > u.account_rows) ? 0 : u.account_rows + account_rows;
+
+	u.stake_bytes = u.stake_rows * stake_bytes;
+	u.account_bytes = u.account_rows * account_bytes;
+	u.ram_bytes = u.stake_rows * (stake_bytes + ROW_RAM_OVERHEAD + INDEX256_RAM_OVERHEAD + INDEX64_RAM_OVERHEAD) +
+				  u.account_rows * (account_bytes + ROW_RAM_OVERHEAD + INDEX256_RAM_OVERHEAD);
+}
+
+//
+// Removes the weight of stakes which expired by [now] from their accounts and the token
+// Their balance is settled at expiry, so they stop diluting live stakes before they are exited
+// At most MAX_EXPIRIES_PER_ACTION stakes are drained, any remainder is drained by later actions
+//
+void atmosstakev2::expire_stakes(token_context &token, eosio::time_point_sec now)
+{
+	stakes stakes_table(_self, token->token_symbol.raw());
+	auto expiry_index = stakes_table.get_index<by_expiry>();
+
+	auto stake = expiry_index.begin();
+	if (stake == expiry_index.end() || stake->byexpiry() > now.sec_since_epoch())
+		return;
+
+	accounts accounts_table(_self, token->token_symbol.raw());
+	auto accounts_index = accounts_table.get_index<by_public_key>();
+
+	auto &st = token.modify();
+
+	for (int i = 0; i < MAX_EXPIRIES_PER_ACTION && stake != expiry_index.end() && stake->byexpiry() <= now.sec_since_epoch(); i++)
+	{
+		// stream up to the moment of expiry, then stop this stake earning
+		st.emit(stake->expires);
+
+		eosio::asset balance = stake->balance;
+		int64_t weight = stake->weight;
+		uint64_t key = stake->key;
+
+		st.total_weight -= weight;
+
+		// a stake without an account only loses its weight, so it cannot block every action on the token
+		auto account = accounts_index.find(stake->bypk());
+		if (account == accounts_index.end())
+		{
+			expiry_index.modify(stake, same_payer, [&](auto &a) {
+				a.weight = 0;
+			});
+		}
+		else
+		{
+			auto acc = *account;
+			acc.fold_emission(st);
+
+			balance = acc.stake_balance(*stake);
+			acc.total_weight -= weight;
+
+			accounts_index.modify(account, same_payer, [&](auto &a) {
+				a = acc;
+			});
+
+			expiry_index.modify(stake, same_payer, [&](auto &a) {
+				a.balance = balance;
+				a.reward_index.emplace(*acc.reward_index);
+				a.weight = 0;
+			});
+		}
+
+		eosio::action(
+			permission_level{_self, "active"_n},
+			_self, "logexpire"_n,
+			std::make_tuple(st.token_symbol, key, balance, weight))
+			.send();
+
+		// the drained stake moved to the end of the index
+		stake = expiry_index.begin();
+	}
+}
+
+//
+// Inline called when receiving a transfer which is a deposit for bulkstake()
+//
+void atmosstakev2::adddeposit(eosio::name owner, eosio::asset balance)
+{
+	deposits deposits_table(_self, balance.symbol.raw());
+
+	auto deposit = deposits_table.find(owner.value);
+	if (deposit == deposits_table.end())
+	{
+		deposits_table.emplace(_self, [&](auto &a) {
+			a.owner = owner;
+			a.balance = balance;
+		});
+	}
+	else
+	{
+		deposits_table.modify(deposit, same_payer, [&](auto &a) {
+			a.balance += balance;
+		});
+	}
+}
+
+//
+// Returns every deposit of [token_symbol] to its owner and erases them
+//
+void atmosstakev2::refund_deposits(eosio::name token_contract, eosio::symbol token_symbol, const char *memo)
+{
+	deposits deposits_table(_self, token_symbol.raw());
+
+	for (auto deposit = deposits_table.begin(); deposit != deposits_table.end();)
+	{
+		eosio::action(
+			permission_level{_self, "active"_n},
+			token_contract, "transfer"_n,
+			std::make_tuple(_self, deposit->owner, deposit->balance, string(memo)))
+			.send();
+
+		deposit = deposits_table.erase(deposit);
+	}
+}
+
+//
+// Inline called when receiving a transfer which is a subsidy
+//
+void atmosstakev2::addsubsidy(token_context &token, eosio::asset balance)
+{
+	auto &st = token.modify();
+	st.emit(eosio::current_time_point_sec());
+	st.subsidy_supply += balance;
+}
+
 //
 // Called on an incoming transfer
 //
@@ -393,31 +1189,39 @@ void atmosstakev2::transfer(eosio::name from, eosio::name to, eosio::asset quant
 	auto arguments = eosio::split_string(memo, " ");
 	eosio::check(arguments.size() > 0, "expected at least one argument");
 
-	stats stats_table(_self, _self.value);
-	auto stat = stats_table.find(quantity.symbol.raw());
-	eosio::check(stat != stats_table.end(), "token is not supported");
+	token_context token(_self, quantity.symbol, "token is not supported");
+	this->expire_stakes(token, eosio::current_time_point_sec());
 
-	string method = arguments[0];
+	const string &method = arguments[0];
 
 	if (method == "stake")
 	{
 		eosio::check(arguments.size() == 3, "expected exactly 3 arguments");
 
 		auto public_key = eosio::public_key_from_string(arguments[1]);
-		auto expires = eosio::current_time_point_sec() + stoi(arguments[2]);
+		auto expires = eosio::current_time_point_sec() + eosio::string_to_int64(arguments[2]);
+
+		this->stake(token, public_key, quantity, expires);
+	}
+	else if (method == "deposit")
+	{
+		eosio::check(arguments.size() == 1, "expected exactly 1 argument");
+		eosio::check(quantity >= token->min_stake, "amount does not meet the minimum stake requirement");
 
-		this->stake(public_key, quantity, expires);
+		this->adddeposit(from, quantity);
 	}
 	else if (method == "addsubsidy")
 	{
 		eosio::check(arguments.size() == 1, "expected exactly 1 argument");
 
-		this->addsubsidy(quantity);
+		this->addsubsidy(token, quantity);
 	}
 	else
 	{
 		eosio::check(false, "unknown method");
 	}
+
+	token.save();
 }
 
 //
@@ -435,7 +1239,7 @@ extern "C"
 			//
 			switch (action)
 			{
-				EOSIO_DISPATCH_HELPER(atmosstakev2, (destroy)(create)(sanity)(exitstake)(fexitstakes)(claim)(resetclaim))
+				EOSIO_DISPATCH_HELPER(atmosstakev2, (destroy)(create)(sanity)(exitstake)(fexitstakes)(claim)(resetclaim)(setroot)(settle)(closeround)(recount)(reindex)(bulkstake)(withdraw)(exportstakes)(logstake)(logexit)(logclaim)(logexpire)(exportbatch))
 			}
 		}
 		else
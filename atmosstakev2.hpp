@@ -6,7 +6,38 @@ using namespace std;
 CONTRACT atmosstakev2 : public eosio::contract
 {
 private:
-    // ...
+    //
+    // WEIGHT CURVES
+    // Each curve is its own instantiation, selected once per stake by weight_of()
+    //
+
+    enum weight_curve_kind : uint8_t
+    {
+        WEIGHT_LINEAR = 0, // units * minutes
+        WEIGHT_TIERED = 1, // minutes past [curve_secs] are weighted at [curve_pct]%
+        WEIGHT_CAPPED = 2, // minutes past [curve_secs] are not weighted
+    };
+
+    // computed in 128 bits, the caller checks the result fits a weight
+    template <uint8_t Curve>
+    static __int128 curve_weight(int64_t units, int64_t minutes, int64_t curve_minutes, int64_t curve_pct)
+    {
+        if constexpr (Curve == WEIGHT_TIERED)
+        {
+            int64_t over = (minutes - curve_minutes) * (minutes > curve_minutes);
+            return (__int128)units * (minutes * 100 + over * (curve_pct - 100)) / 100;
+        }
+        else if constexpr (Curve == WEIGHT_CAPPED)
+        {
+            int64_t over = (minutes - curve_minutes) * (minutes > curve_minutes);
+            return (__int128)units * (minutes - over);
+        }
+        else
+        {
+            return (__int128)units * minutes;
+        }
+    }
+
 public:
     using eosio::contract::contract;
 
@@ -20,8 +51,12 @@ public:
         int64_t weight;
         eosio::public_key public_key;
         eosio::asset initial_balance;
-        eosio::asset balance;
+        eosio::asset balance; // settled at [reward_index], account::stake_balance() adds the rewards paid since
         eosio::time_point_sec expires;
+        eosio::binary_extension<uint128_t> reward_index; // account reward index when [balance] was settled, missing is 0
+
+        // stakes still carrying weight, in the order their weight expires
+        uint64_t byexpiry() const { return weight > 0 ? expires.sec_since_epoch() : UINT64_MAX; }
 
         TABLE_PRIMARY_KEY(key);
         TABLE_SECONDARY_PUBLIC_KEY(public_key);
@@ -41,6 +76,104 @@ public:
         int64_t max_stake_secs;
         eosio::asset min_stake;
 
+        //
+        // Added after launch, rows written before then end at [min_stake]
+        // upgrade() fills in what is missing, it must run before any of these is read or written
+        //
+        eosio::binary_extension<uint8_t> weight_curve;
+        eosio::binary_extension<int64_t> curve_secs;
+        eosio::binary_extension<int64_t> curve_pct;
+        eosio::binary_extension<eosio::asset> emission_rate;   // streamed from the subsidy supply per second, zero disables streaming
+        eosio::binary_extension<eosio::asset> streamed_supply; // streamed but not yet folded into accounts
+        eosio::binary_extension<eosio::time_point_sec> last_emission;
+        eosio::binary_extension<uint128_t> emission_index; // cumulative streamed amount per weight unit, scaled by REWARD_INDEX_PRECISION
+
+        // extensions are serialized in order, so either all of them are written or none
+        void upgrade(eosio::time_point_sec now)
+        {
+            if (!weight_curve.has_value())
+                weight_curve.emplace(WEIGHT_LINEAR);
+            if (!curve_secs.has_value())
+                curve_secs.emplace(0);
+            if (!curve_pct.has_value())
+                curve_pct.emplace(0);
+            if (!emission_rate.has_value())
+                emission_rate.emplace(0, token_symbol);
+            if (!streamed_supply.has_value())
+                streamed_supply.emplace(0, token_symbol);
+            if (!last_emission.has_value())
+                last_emission.emplace(now);
+            if (!emission_index.has_value())
+                emission_index.emplace(0);
+        }
+
+        // streams the subsidy accrued since [last_emission] into the emission index
+        void emit(eosio::time_point_sec now)
+        {
+            upgrade(now);
+
+            if (now <= *last_emission)
+                return;
+
+            int64_t elapsed = eosio::time_diff_secs(now, *last_emission);
+            *last_emission = now;
+
+            if (emission_rate->amount <= 0 || total_weight <= 0)
+                return;
+
+            int64_t amount = (int64_t)std::min((__int128)emission_rate->amount * elapsed, (__int128)subsidy_supply.amount);
+            if (amount <= 0)
+                return;
+
+            subsidy_supply.amount -= amount;
+            streamed_supply->amount += amount;
+            *emission_index += (uint128_t)amount * REWARD_INDEX_PRECISION / total_weight;
+        }
+
+        // validates a stake of [balance] until [expires] against this token's limits and returns its weight
+        int64_t stake_weight(eosio::asset balance, eosio::time_point_sec expires, eosio::time_point_sec now) const
+        {
+            eosio::check(balance.symbol == token_symbol, "symbol does not match the token");
+            eosio::check(balance >= min_stake, "amount does not meet the minimum stake requirement");
+            eosio::check(expires >= (now + min_stake_secs), "the staking period is too short");
+            eosio::check(expires <= (now + max_stake_secs), "the staking period is too long");
+
+            int64_t weight = weight_of(balance, eosio::time_diff_secs(expires, now));
+            eosio::check(weight > 0, "weight must be greater than zero");
+            return weight;
+        }
+
+        int64_t weight_of(eosio::asset balance, int64_t secs) const
+        {
+            int64_t units = balance.amount / 10000;
+            int64_t minutes = secs / 60;
+            int64_t curve_minutes = *curve_secs / 60;
+
+            __int128 weight;
+            switch (*weight_curve)
+            {
+            case WEIGHT_TIERED:
+                weight = curve_weight<WEIGHT_TIERED>(units, minutes, curve_minutes, *curve_pct);
+                break;
+            case WEIGHT_CAPPED:
+                weight = curve_weight<WEIGHT_CAPPED>(units, minutes, curve_minutes, *curve_pct);
+                break;
+            default:
+                weight = curve_weight<WEIGHT_LINEAR>(units, minutes, curve_minutes, *curve_pct);
+                break;
+            }
+
+            eosio::check(weight <= INT64_MAX, "weight is too large");
+            return (int64_t)weight;
+        }
+
+        // adds the [weight] of new stakes, which must not overflow the total
+        void add_weight(int64_t weight)
+        {
+            eosio::check(weight <= INT64_MAX - total_weight, "total weight is too large");
+            total_weight += weight;
+        }
+
         TABLE_PRIMARY_KEY(token_symbol.raw());
     };
 
@@ -51,13 +184,194 @@ public:
         eosio::asset total_balance;
         uint64_t total_weight;
 
+        //
+        // Added after launch, a missing index is 0 which is where both indexes started
+        // Stakes written before then carry their full balance, which is settled at index 0
+        //
+        eosio::binary_extension<uint128_t> reward_index; // cumulative reward per weight unit, scaled by REWARD_INDEX_PRECISION
+        eosio::binary_extension<uint128_t> emission_index; // stat emission index when streamed rewards were last folded in
+
+        void upgrade()
+        {
+            if (!reward_index.has_value())
+                reward_index.emplace(0);
+            if (!emission_index.has_value())
+                emission_index.emplace(0);
+        }
+
+        // [s] balance including its share of rewards paid to this account since it was settled
+        eosio::asset stake_balance(const stake &s) const
+        {
+            uint128_t index = reward_index.has_value() ? *reward_index : 0;
+            uint128_t settled = s.reward_index.has_value() ? *s.reward_index : 0;
+
+            int64_t reward = (int64_t)((uint128_t)s.weight * (index - settled) / REWARD_INDEX_PRECISION);
+            return s.balance + eosio::asset(reward, s.balance.symbol);
+        }
+
+        // spreads [reward] over the stakes of this account by their weight
+        void add_reward(eosio::asset reward)
+        {
+            upgrade();
+
+            total_balance += reward;
+            if (total_weight > 0)
+                *reward_index += (uint128_t)reward.amount * REWARD_INDEX_PRECISION / total_weight;
+        }
+
+        // moves rewards streamed to this account since it was last folded out of [st] streamed supply
+        // must be called before [total_weight] changes
+        void fold_emission(stat &st)
+        {
+            upgrade();
+
+            int64_t amount = (int64_t)((uint128_t)total_weight * (*st.emission_index - *emission_index) / REWARD_INDEX_PRECISION);
+            *emission_index = *st.emission_index;
+
+            if (amount <= 0)
+                return;
+
+            eosio::asset reward(amount, st.token_symbol);
+            add_reward(reward);
+            *st.streamed_supply -= reward;
+            st.total_supply += reward;
+        }
+
+        TABLE_PRIMARY_KEY(key);
+        TABLE_SECONDARY_PUBLIC_KEY(public_key);
+    };
+
+    TABLE root
+    {
+        uint64_t round;
+        eosio::symbol token_symbol;
+        eosio::checksum256 merkle_root; // of sha256(pack(round, public_key, reward)) leaves
+        eosio::asset remaining;         // reserved subsidy not yet settled, returned by closeround()
+        eosio::time_point_sec created;
+
+        TABLE_PRIMARY_KEY(round);
+    };
+
+    TABLE receipt
+    {
+        uint64_t key;
+        eosio::public_key public_key;
+
         TABLE_PRIMARY_KEY(key);
         TABLE_SECONDARY_PUBLIC_KEY(public_key);
     };
 
-    typedef eosio::multi_index<"stakes"_n, stake, eosio::index_by_public_key<stake>> stakes;
+    TABLE usage
+    {
+        eosio::symbol token_symbol;
+        uint64_t stake_rows;
+        uint64_t stake_bytes; // serialized
+        uint64_t account_rows;
+        uint64_t account_bytes; // serialized
+        uint64_t ram_bytes;     // estimated RAM billed to the contract for both tables
+        uint64_t stake_cursor;   // next stake key recount() scans, UINT64_MAX once stakes are counted
+        uint64_t account_cursor; // next account key recount() scans, UINT64_MAX once accounts are counted
+
+        TABLE_PRIMARY_KEY(token_symbol.raw());
+    };
+
+    TABLE deposit
+    {
+        eosio::name owner;
+        eosio::asset balance; // awaiting bulkstake()
+
+        TABLE_PRIMARY_KEY(owner.value);
+    };
+
+    typedef eosio::multi_index<"stakes"_n, stake, eosio::index_by_public_key<stake>, eosio::indexed_by<by_expiry, eosio::const_mem_fun<stake, uint64_t, &stake::byexpiry>>> stakes;
     typedef eosio::multi_index<"stats"_n, stat> stats;
     typedef eosio::multi_index<"accounts"_n, account, eosio::index_by_public_key<account>> accounts;
+    typedef eosio::multi_index<"roots"_n, root> roots;
+    typedef eosio::multi_index<"receipts"_n, receipt, eosio::index_by_public_key<receipt>> receipts; // scoped by round
+    typedef eosio::multi_index<"usages"_n, usage> usages;
+    typedef eosio::multi_index<"deposits"_n, deposit> deposits;
+
+    //
+    // TOKEN CONTEXT
+    // Reads the stat row of a token once per action, changes are made to the copy
+    // and written back by a single save() only if modify() was called
+    // The copy is upgraded on load, so rows written before the extensions are rewritten whole
+    //
+
+    class token_context
+    {
+    public:
+        token_context(eosio::name self, eosio::symbol token_symbol, const char *not_found = "token not found")
+            : _table(self, self.value), _it(_table.find(token_symbol.raw()))
+        {
+            eosio::check(_it != _table.end(), not_found);
+            _stat = *_it;
+            _stat.upgrade(eosio::current_time_point_sec());
+        }
+
+        const stat *operator->() const { return &_stat; }
+        const stat &operator*() const { return _stat; }
+
+        stat &modify()
+        {
+            _dirty = true;
+            return _stat;
+        }
+
+        void save()
+        {
+            if (!_dirty)
+                return;
+
+            _table.modify(_it, eosio::same_payer, [&](auto &a) {
+                a = _stat;
+            });
+            _dirty = false;
+        }
+
+    private:
+        stats _table;
+        stats::const_iterator _it;
+        stat _stat;
+        bool _dirty = false;
+    };
+
+    //
+    // PARAMETER TYPES
+    //
+
+    struct bulk_entry
+    {
+        eosio::public_key public_key;
+        eosio::asset balance;
+        eosio::time_point_sec expires;
+
+        EOSLIB_SERIALIZE(bulk_entry, (public_key)(balance)(expires));
+    };
+
+    //
+    // EXPORT TYPES
+    //
+
+    struct export_row
+    {
+        uint64_t key;
+        int64_t weight;
+        eosio::asset balance;
+        eosio::time_point_sec expires;
+        uint64_t account_key;
+
+        EOSLIB_SERIALIZE(export_row, (key)(weight)(balance)(expires)(account_key));
+    };
+
+    struct export_batch
+    {
+        std::vector<export_row> rows;
+        uint64_t next_key; // pass as [lower_bound] to continue
+        bool more;
+
+        EOSLIB_SERIALIZE(export_batch, (rows)(next_key)(more));
+    };
 
     //
     // ACTIONS
@@ -72,17 +386,46 @@ public:
         int64_t min_claim_secs,
         int64_t min_stake_secs,
         int64_t max_stake_secs,
-        eosio::asset min_stake);
+        eosio::asset min_stake,
+        uint8_t weight_curve,
+        int64_t curve_secs,
+        int64_t curve_pct,
+        eosio::asset emission_rate);
     ACTION exitstake(uint64_t key, eosio::symbol token_symbol, eosio::name to, string memo, eosio::signature sig);
     ACTION fexitstakes(eosio::symbol token_symbol, eosio::name stakes_to, eosio::name supply_to);
     ACTION claim(eosio::symbol token_symbol, eosio::name relay, string memo);
     ACTION resetclaim(eosio::symbol token_symbol);
+    ACTION setroot(eosio::symbol token_symbol, eosio::checksum256 merkle_root);
+    ACTION settle(uint64_t round, eosio::public_key public_key, eosio::asset reward, std::vector<eosio::checksum256> proof);
+    ACTION closeround(uint64_t round, uint32_t max_rows);
+    ACTION recount(eosio::symbol token_symbol, uint32_t max_rows);
+    ACTION reindex(eosio::symbol token_symbol, uint64_t lower_bound, uint32_t max_rows);
+    ACTION bulkstake(eosio::name owner, eosio::symbol token_symbol, std::vector<bulk_entry> entries);
+    ACTION withdraw(eosio::name owner, eosio::asset quantity);
+    ACTION exportstakes(eosio::symbol token_symbol, uint64_t lower_bound, uint32_t max_bytes);
+
+    //
+    // CHANGE LOG ACTIONS
+    // Inline sent to self so off-chain mirrors can follow changes from action traces
+    //
+
+    ACTION logstake(eosio::symbol token_symbol, uint64_t key, eosio::public_key public_key, eosio::asset balance, int64_t weight, eosio::time_point_sec expires);
+    ACTION logexit(eosio::symbol token_symbol, uint64_t key, eosio::asset balance);
+    ACTION logclaim(eosio::symbol token_symbol, eosio::time_point_sec round, eosio::asset subsidy, int64_t total_weight);
+    ACTION logexpire(eosio::symbol token_symbol, uint64_t key, eosio::asset balance, int64_t weight);
+    ACTION exportbatch(eosio::symbol token_symbol, export_batch batch);
 
     //
     // INTERNAL CALLED ACTIONS
     //
 
     void transfer(eosio::name from, eosio::name to, eosio::asset quantity, string memo);
-    void stake(eosio::public_key public_key, eosio::asset balance, eosio::time_point_sec expires);
-    void addsubsidy(eosio::asset balance);
+    void stake(token_context &token, eosio::public_key public_key, eosio::asset balance, eosio::time_point_sec expires);
+    void addsubsidy(token_context &token, eosio::asset balance);
+    void adddeposit(eosio::name owner, eosio::asset balance);
+    void refund_deposits(eosio::name token_contract, eosio::symbol token_symbol, const char *memo);
+    account upsert_account(stat &st, accounts &accounts_table, const eosio::public_key &public_key, const eosio::checksum256 &pk, eosio::asset balance, int64_t weight, bool &created);
+    void track_usage(eosio::symbol token_symbol, uint64_t stake_key, int64_t stake_rows, uint64_t account_key, int64_t account_rows);
+    static void count_rows(usage &u, int64_t stake_rows, int64_t account_rows);
+    void expire_stakes(token_context &token, eosio::time_point_sec now);
 };
\ No newline at end of file
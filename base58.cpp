@@ -8,6 +8,10 @@
 
 #include <eosio/eosio.hpp>
 
+// Largest binary payload handled, EOS public keys are 37 bytes with their checksum
+#define B58_MAX_BIN_SIZE (64)
+#define B58_MAX_DIGITS (B58_MAX_BIN_SIZE * 138 / 100 + 1)
+
 static const char b58digits_ordered[] = "123456789ABCDEFGHJKLMNPQRSTUVWXYZabcdefghijkmnopqrstuvwxyz";
 
 static const int8_t b58digits_map[] = {
@@ -147,11 +151,14 @@ bool b58enc(char *b58, size_t *b58sz, const uint8_t *bin, size_t binsz)
     ssize_t i, j, high, zcount = 0;
     size_t size;
 
+    if (binsz > B58_MAX_BIN_SIZE)
+        return false;
+
     while (zcount < (ssize_t)binsz && !bin[zcount])
         ++zcount;
 
     size = (binsz - zcount) * 138 / 100 + 1;
-    uint8_t buf[size];
+    uint8_t buf[B58_MAX_DIGITS];
     memset(buf, 0, size);
 
     for (i = zcount, high = size - 1; i < (ssize_t)binsz; ++i, high = j)
@@ -187,7 +194,7 @@ bool b58tobin(void *bin, size_t *binszp, const char *b58)
 {
     size_t binsz = *binszp;
 
-    if (binsz == 0)
+    if (binsz == 0 || binsz > B58_MAX_BIN_SIZE)
     {
         return false;
     }
@@ -195,7 +202,7 @@ bool b58tobin(void *bin, size_t *binszp, const char *b58)
     const unsigned char *b58u = (const unsigned char *)b58;
     unsigned char *binu = (unsigned char *)bin;
     size_t outisz = (binsz + 3) / 4;
-    uint32_t outi[outisz];
+    uint32_t outi[(B58_MAX_BIN_SIZE + 3) / 4];
     uint64_t t;
     uint32_t c;
     size_t i, j;
@@ -290,11 +297,14 @@ bool b58enc(char *b58, size_t *b58sz, const void *data, size_t binsz)
     size_t i, j, high, zcount = 0;
     size_t size;
 
+    if (binsz > B58_MAX_BIN_SIZE)
+        return false;
+
     while (zcount < binsz && !bin[zcount])
         ++zcount;
 
     size = (binsz - zcount) * 138 / 100 + 1;
-    uint8_t buf[size];
+    uint8_t buf[B58_MAX_DIGITS];
     memset(buf, 0, size);
 
     for (i = zcount, high = size - 1; i < binsz; ++i, high = j)
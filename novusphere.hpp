@@ -6,7 +6,9 @@
 
 #include <string>
 #include <vector>
-#include <memory>
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
 
 #define TABLE_PRIMARY_KEY(value) \
     uint64_t primary_key() const { return value; }
@@ -19,8 +21,15 @@
 #define MINUTE_IN_SECS (60)
 #define DAY_IN_SECS (86400)
 #define YEAR_IN_SECS (31536000)
+#define REWARD_INDEX_PRECISION ((uint128_t)1000000000000000000ULL)
+#define ROW_RAM_OVERHEAD (112)       // approximate RAM billed per row on top of its serialized size
+#define INDEX256_RAM_OVERHEAD (144)  // approximate RAM billed per 256-bit secondary index entry
+#define INDEX64_RAM_OVERHEAD (112)   // approximate RAM billed per 64-bit secondary index entry
+#define MAX_EXPIRIES_PER_ACTION (100)
+#define MAX_EXPORT_BYTES (500 * 1024) // under the default max_inline_action_size of 512 KiB
 
 #define by_public_key (eosio::name("bypk"))
+#define by_expiry (eosio::name("byexpiry"))
 
 extern bool b58tobin(void *bin, size_t *binszp, const char *b58);
 extern bool b58enc(char *b58, size_t *b58sz, const void *data, size_t binsz);
@@ -34,33 +43,74 @@ namespace eosio
     {
     };
 
-    template <typename... Args>
-    inline std::string format_string(const char *format, Args... args)
+    //
+    // Formats into the caller's [buf] without touching the heap, the output is truncated to fit
+    //
+    inline size_t vformat_to(char *buf, size_t size, const char *format, va_list args)
     {
-        //
-        // https://stackoverflow.com/questions/2342162/stdstring-formatting-like-sprintf
-        //
-
-        size_t size = snprintf(nullptr, 0, format, args...) + 1; // Extra space for '\0'
-        eosio::check(size > 0, "Error during formatting.");
-
-        std::unique_ptr<char[]> buf(new char[size]);
-        snprintf(buf.get(), size, format, args...);
-        return std::string(buf.get(), buf.get() + size - 1); // We don't want the '\0' inside
+        int len = vsnprintf(buf, size, format, args);
+        eosio::check(len >= 0, "Error during formatting.");
+        return (size_t)len < size ? (size_t)len : size - 1;
     }
 
-    template <typename... Args>
-    inline void checkf(bool pred, const char *format, Args... args)
+    // the format attribute lets the compiler check [format] against the arguments
+    __attribute__((format(printf, 2, 3))) inline void checkf(bool pred, const char *format, ...)
     {
         if (!pred)
         {
-            // call lazily if [pred] is false
-            std::string msg = eosio::format_string(format, args...);
+            // format lazily if [pred] is false
+            char msg[512];
+
+            va_list args;
+            va_start(args, format);
+            vformat_to(msg, sizeof(msg), format, args);
+            va_end(args);
+
             eosio::check(pred, msg);
         }
     }
 
-    inline vector<string> split_string(string s, string delimiter)
+    //
+    // Fixed capacity string built on the stack by direct concatenation
+    //
+    template <size_t N>
+    struct fixed_string
+    {
+        char data[N];
+        size_t size = 0;
+
+        fixed_string &append(const char *s, size_t len)
+        {
+            eosio::check(len <= N - size, "fixed string capacity exceeded");
+            memcpy(data + size, s, len);
+            size += len;
+            return *this;
+        }
+
+        fixed_string &append(const char *s) { return append(s, strlen(s)); }
+        fixed_string &append(const string &s) { return append(s.data(), s.size()); }
+
+        fixed_string &append(uint64_t value)
+        {
+            char digits[20];
+            size_t len = 0;
+            do
+            {
+                digits[sizeof(digits) - ++len] = '0' + (value % 10);
+                value /= 10;
+            } while (value > 0);
+            return append(digits + sizeof(digits) - len, len);
+        }
+
+        fixed_string &append(eosio::name value)
+        {
+            char buf[13];
+            char *end = value.write_as_string(buf, buf + sizeof(buf));
+            return append(buf, end - buf);
+        }
+    };
+
+    inline vector<string> split_string(const string &s, const string &delimiter)
     {
         //
         // https://stackoverflow.com/questions/14265581/parse-split-a-string-in-c-using-string-delimiter-standard-c
@@ -81,6 +131,24 @@ namespace eosio
         return res;
     }
 
+    inline int64_t string_to_int64(const string &s)
+    {
+        // stoi() aborts without a message in wasm, parse strictly instead
+        eosio::check(s.size() > 0 && s.size() <= 18, "expected an integer of 1 to 18 digits");
+
+        size_t i = (s[0] == '-') ? 1 : 0;
+        eosio::check(i < s.size(), "expected an integer of 1 to 18 digits");
+
+        int64_t value = 0;
+        for (; i < s.size(); i++)
+        {
+            eosio::check(s[i] >= '0' && s[i] <= '9', "expected an integer of 1 to 18 digits");
+            value = value * 10 + (s[i] - '0');
+        }
+
+        return (s[0] == '-') ? -value : value;
+    }
+
     inline eosio::uint32_t time_diff_secs(eosio::time_point_sec tp1, eosio::time_point_sec tp2)
     {
         return tp1.sec_since_epoch() - tp2.sec_since_epoch();
@@ -96,14 +164,20 @@ namespace eosio
         return eosio::sha256((const char *)publickey.data.begin(), 33);
     }
 
-    inline const eosio::public_key public_key_from_string(const std::string str)
+    inline const eosio::public_key public_key_from_string(const std::string &str)
     {
         eosio::check(str.size() == 53, "str must be a 53-char EOS public key");
-        eosio::check(str.substr(0, 3) == "EOS", "public key must start with EOS");
+        eosio::check(str.compare(0, 3, "EOS") == 0, "public key must start with EOS");
 
-        eosio::public_key pk;
+        //
+        // b58tobin() writes the 4 byte checksum past the 33 key bytes
+        //
+        uint8_t key[37];
         size_t pk_len = 37;
-        eosio::check(b58tobin((void *)pk.data.data(), &pk_len, str.substr(3).c_str()), "failed b58 decode");
+        eosio::check(b58tobin((void *)key, &pk_len, str.c_str() + 3), "failed b58 decode");
+
+        eosio::public_key pk;
+        memcpy((void *)pk.data.data(), key, 33);
 
         return pk;
     }
@@ -124,6 +198,28 @@ namespace eosio
         return string(b58);
     }
 
+    //
+    // Folds [proof] into [leaf], each pair is hashed in sorted order so no position bits are needed
+    //
+    inline eosio::checksum256 merkle_root_from_proof(eosio::checksum256 leaf, const vector<eosio::checksum256> &proof)
+    {
+        for (const auto &sibling : proof)
+        {
+            const eosio::checksum256 &lo = (sibling < leaf) ? sibling : leaf;
+            const eosio::checksum256 &hi = (sibling < leaf) ? leaf : sibling;
+
+            uint8_t pair[64];
+            auto lo_bytes = lo.extract_as_byte_array();
+            auto hi_bytes = hi.extract_as_byte_array();
+            memcpy(&pair[0], lo_bytes.data(), 32);
+            memcpy(&pair[32], hi_bytes.data(), 32);
+
+            leaf = eosio::sha256((const char *)pair, sizeof(pair));
+        }
+
+        return leaf;
+    }
+
     template <name::raw A, typename B, typename... C>
     inline void clear_table(multi_index<A, B, C...> &table)
     {